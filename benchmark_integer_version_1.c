@@ -5,30 +5,17 @@
 
 #define GIB_DIVISOR (1024.0 * 1024.0 * 1024.0)
 
-typedef enum BrinAffinity {
-    BRIN_TYPE_INTEGER,
-    BRIN_TYPE_REAL,
-    BRIN_TYPE_TEXT
-} BrinAffinity;
+/*
+ * Mirrors the per-block storage of brin.c: five parallel
+ * arrays (min, max, start_rowid, end_rowid, rows), 8 bytes each.
+ */
+typedef union BrinKey {
+    sqlite3_int64 i;
+    double r;
+} BrinKey;
 
-typedef struct BrinRange {
-    BrinAffinity type;
-
-    union {
-        struct {
-            double min;
-            double max;
-        } num;
-
-        struct {
-            sqlite3_int64 min_epoch;
-            sqlite3_int64 max_epoch;
-        } txt;
-    } u;
-
-    sqlite3_int64 start_rowid;
-    sqlite3_int64 end_rowid;
-} BrinRange;
+#define BRIN_BLOCK_BYTES \
+    (2 * sizeof(BrinKey) + 3 * sizeof(sqlite3_int64))
 
 
 double print_brin_vtab_size(sqlite3 *db, int block_size)
@@ -86,14 +73,14 @@ double print_brin_vtab_size(sqlite3 *db, int block_size)
     }
 
     brin_bytes =
-        total_blocks * (sqlite3_int64)sizeof(BrinRange);
+        total_blocks * (sqlite3_int64)BRIN_BLOCK_BYTES;
 
     brin_gib =
         (double)brin_bytes / GIB_DIVISOR;
 
     printf("----------------------------------------\n");
     printf("BRIN VTab estimated in-memory size\n");
-    printf("sizeof(BrinRange): %zu bytes\n", sizeof(BrinRange));
+    printf("bytes per block: %zu\n", BRIN_BLOCK_BYTES);
     printf("total_rows: %lld\n", (long long)total_rows);
     printf("estimated_blocks: %lld\n", (long long)total_blocks);
     printf("BRIN SIZE: %lld bytes\n", (long long)brin_bytes);
@@ -0,0 +1,835 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+/*
+ * Regression checks for brin.so. Build the extension first, then:
+ *
+ *   gcc -O2 test_regressions_version_1.c -o test_regressions -lsqlite3
+ *   ./test_regressions
+ *
+ * Every case works on its own scratch database (regress_*.db) in the
+ * current directory and loads ./brin.so. The exit status is the number
+ * of failed checks.
+ */
+
+#define TEST_ROWS 100000
+
+static int failures = 0;
+
+static void check(const char *name, int ok)
+{
+    printf("%s %s\n", ok ? "PASS" : "FAIL", name);
+
+    if (!ok)
+        failures++;
+}
+
+static void remove_db(const char *path)
+{
+    char buf[256];
+
+    remove(path);
+    snprintf(buf, sizeof(buf), "%s-wal", path);
+    remove(buf);
+    snprintf(buf, sizeof(buf), "%s-shm", path);
+    remove(buf);
+    snprintf(buf, sizeof(buf), "%s-journal", path);
+    remove(buf);
+}
+
+static int exec_sql(sqlite3 *db, const char *sql)
+{
+    char *err_msg = NULL;
+    int rc = sqlite3_exec(db, sql, NULL, NULL, &err_msg);
+
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\nSQL: %s\n",
+                err_msg ? err_msg : sqlite3_errmsg(db),
+                sql);
+        sqlite3_free(err_msg);
+    }
+
+    return rc;
+}
+
+/*
+ * Runs a query returning one integer. Returns SQLITE_OK and
+ * stores the value, or the error code of the query.
+ */
+static int query_int64(sqlite3 *db, const char *sql, sqlite3_int64 *out)
+{
+    sqlite3_stmt *stmt = NULL;
+    int rc;
+
+    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_step(stmt);
+
+        if (rc == SQLITE_ROW) {
+            *out = sqlite3_column_int64(stmt, 0);
+            rc = SQLITE_OK;
+        }
+    }
+
+    if (rc != SQLITE_OK)
+        fprintf(stderr, "SQL error: %s\nSQL: %s\n", sqlite3_errmsg(db), sql);
+
+    sqlite3_finalize(stmt);
+
+    return rc;
+}
+
+static sqlite3 *open_db(const char *path)
+{
+    sqlite3 *db = NULL;
+    char *err_msg = NULL;
+
+    if (sqlite3_open(path, &db) != SQLITE_OK) {
+        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    sqlite3_enable_load_extension(db, 1);
+
+    if (sqlite3_load_extension(db, "./brin.so", "sqlite3_brin_init",
+                               &err_msg) != SQLITE_OK)
+    {
+        fprintf(stderr, "Failed to load brin.so: %s\n",
+                err_msg ? err_msg : sqlite3_errmsg(db));
+        sqlite3_free(err_msg);
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    return db;
+}
+
+static int file_exists(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+
+    if (f)
+        fclose(f);
+
+    return f != NULL;
+}
+
+/*
+ * A fresh database with logs(id, v), v = 10 * id for
+ * rowids 1..TEST_ROWS.
+ */
+static sqlite3 *create_db(const char *path)
+{
+    char sql[512];
+    sqlite3 *db;
+
+    remove_db(path);
+
+    db = open_db(path);
+    if (!db)
+        return NULL;
+
+    snprintf(sql, sizeof(sql),
+        "PRAGMA journal_mode = WAL;"
+        "CREATE TABLE logs (id INTEGER PRIMARY KEY, v INTEGER);"
+        "WITH RECURSIVE c(x) AS "
+        "(SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < %d) "
+        "INSERT INTO logs SELECT x, x * 10 FROM c;",
+        TEST_ROWS);
+
+    if (exec_sql(db, sql) != SQLITE_OK) {
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    return db;
+}
+
+/*
+ * Rows the index finds for v BETWEEN lo AND hi, through the
+ * documented join, minus the rows actually in that range.
+ * 0 when the index is exact.
+ */
+static int join_mismatch(sqlite3 *db, const char *idx,
+                         sqlite3_int64 lo, sqlite3_int64 hi)
+{
+    sqlite3_int64 found = -1, truth = -2;
+    char sql[1024];
+
+    snprintf(sql, sizeof(sql),
+        "SELECT "
+        "(SELECT count(*) FROM %s b JOIN logs l "
+        "ON l.rowid BETWEEN b.start_rowid AND b.end_rowid "
+        "WHERE b.min <= %lld AND b.max >= %lld AND b.needs_recheck = 0) + "
+        "(SELECT count(*) FROM %s b JOIN logs l "
+        "ON l.rowid BETWEEN b.start_rowid AND b.end_rowid "
+        "WHERE b.min <= %lld AND b.max >= %lld AND b.needs_recheck = 1 "
+        "AND l.v BETWEEN %lld AND %lld);",
+        idx, (long long)hi, (long long)lo,
+        idx, (long long)hi, (long long)lo, (long long)lo, (long long)hi);
+
+    if (query_int64(db, sql, &found) != SQLITE_OK)
+        return 1;
+
+    snprintf(sql, sizeof(sql),
+        "SELECT count(*) FROM logs WHERE v BETWEEN %lld AND %lld;",
+        (long long)lo, (long long)hi);
+
+    if (query_int64(db, sql, &truth) != SQLITE_OK)
+        return 1;
+
+    return found != truth;
+}
+
+/* ===== maintain=commit ===== */
+
+static int app_updates = 0;
+static int app_commits = 0;
+static int catchup_scans = 0;
+
+static void app_update_hook(void *arg, int op, const char *db,
+                            const char *tbl, sqlite3_int64 rowid)
+{
+    (void)arg; (void)op; (void)db; (void)tbl; (void)rowid;
+    app_updates++;
+}
+
+static int app_commit_hook(void *arg)
+{
+    (void)arg;
+    app_commits++;
+    return 0;
+}
+
+/*
+ * Counts the catch-up scans of the extension, which read the rows
+ * past the last indexed rowid.
+ */
+static int count_catchup_scans(unsigned type, void *ctx, void *p, void *x)
+{
+    (void)ctx; (void)p;
+
+    if (type == SQLITE_TRACE_STMT && strstr((const char*)x, "WHERE rowid > ?"))
+        catchup_scans++;
+
+    return 0;
+}
+
+/*
+ * The hooks the application set before opening a maintain=commit
+ * table keep firing.
+ */
+static void test_commit_keeps_app_hooks(void)
+{
+    const char *path = "regress_commit_hooks.db";
+    sqlite3 *db = create_db(path);
+    int ok = db != NULL;
+
+    if (ok) {
+        sqlite3_update_hook(db, app_update_hook, NULL);
+        sqlite3_commit_hook(db, app_commit_hook, NULL);
+    }
+
+    ok = ok && exec_sql(db,
+        "CREATE VIRTUAL TABLE b USING brin(logs, v, 128, maintain=commit);"
+        "SELECT count(*) FROM b;") == SQLITE_OK;
+
+    app_updates = app_commits = 0;
+
+    ok = ok &&
+         exec_sql(db, "INSERT INTO logs (v) VALUES (99999999);") == SQLITE_OK &&
+         join_mismatch(db, "b", 0, 100000000) == 0;
+
+    check("commit: application update and commit hooks still fire",
+          ok && app_updates == 1 && app_commits >= 1);
+
+    sqlite3_close(db);
+    remove_db(path);
+}
+
+/*
+ * An index in an attached database is folded by commits to that
+ * database, and not by inserts into a same-named table in main.
+ */
+static void test_commit_attached_schema(void)
+{
+    const char *path = "regress_commit_main.db";
+    const char *aux = "regress_commit_aux.db";
+    sqlite3 *db;
+    sqlite3_int64 top = 0;
+    int ok, own = 0, other = 0;
+    char sql[512];
+
+    remove_db(aux);
+    db = create_db(path);
+    ok = db != NULL;
+
+    snprintf(sql, sizeof(sql),
+        "ATTACH '%s' AS aux;"
+        "PRAGMA aux.journal_mode = WAL;"
+        "CREATE TABLE aux.logs (id INTEGER PRIMARY KEY, v INTEGER);"
+        "WITH RECURSIVE c(x) AS "
+        "(SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 1000) "
+        "INSERT INTO aux.logs SELECT x, x FROM c;"
+        "CREATE VIRTUAL TABLE aux.b USING brin(logs, v, 128, maintain=commit);"
+        "SELECT count(*) FROM aux.b;",
+        aux);
+
+    ok = ok && exec_sql(db, sql) == SQLITE_OK;
+
+    if (ok) {
+        sqlite3_trace_v2(db, SQLITE_TRACE_STMT, count_catchup_scans, NULL);
+
+        catchup_scans = 0;
+        ok = exec_sql(db, "INSERT INTO aux.logs (v) VALUES (5000);") == SQLITE_OK;
+        own = catchup_scans == 1;
+
+        catchup_scans = 0;
+        ok = ok &&
+             exec_sql(db, "INSERT INTO main.logs (v) VALUES (1);") == SQLITE_OK;
+        other = catchup_scans == 0;
+
+        sqlite3_trace_v2(db, 0, NULL, NULL);
+    }
+
+    ok = ok &&
+         query_int64(db, "SELECT max(max) FROM aux.b;", &top) == SQLITE_OK &&
+         top == 5000;
+
+    check("commit: attached index folded by its own commit", ok && own);
+    check("commit: insert into main does not fold the attached index",
+          ok && other);
+
+    sqlite3_close(db);
+    remove_db(path);
+    remove_db(aux);
+}
+
+/* ===== threads=K ===== */
+
+/*
+ * A parallel build of an index in an attached database, with a
+ * different table of the same name in main.
+ */
+static void test_parallel_attached_schema(void)
+{
+    const char *path = "regress_parallel_main.db";
+    const char *aux = "regress_parallel_aux.db";
+    sqlite3 *db;
+    sqlite3_int64 n = -1, serial = -1;
+    char sql[1024];
+    int ok;
+
+    remove_db(aux);
+    db = create_db(path);
+
+    snprintf(sql, sizeof(sql),
+        "ATTACH '%s' AS aux;"
+        "PRAGMA aux.journal_mode = WAL;"
+        "CREATE TABLE aux.logs (id INTEGER PRIMARY KEY, v INTEGER);"
+        "WITH RECURSIVE c(x) AS "
+        "(SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 20000) "
+        "INSERT INTO aux.logs SELECT x, x FROM c;"
+        "CREATE VIRTUAL TABLE aux.bi USING brin(logs, v, 64, threads=4);"
+        "CREATE VIRTUAL TABLE aux.bs USING brin(logs, v, 64);",
+        aux);
+
+    ok = db != NULL && exec_sql(db, sql) == SQLITE_OK &&
+         query_int64(db, "SELECT brin_count('aux.bi', 500, 600);",
+                     &n) == SQLITE_OK &&
+         query_int64(db, "SELECT brin_count('aux.bs', 500, 600);",
+                     &serial) == SQLITE_OK;
+
+    check("threads: parallel build reads the attached table",
+          ok && n == 101);
+    check("threads: serial index on the same table agrees",
+          ok && serial == 101);
+
+    sqlite3_close(db);
+    remove_db(path);
+    remove_db(aux);
+}
+
+/* ===== shared summaries ===== */
+
+/*
+ * A table dropped and recreated under the same name, indexed again
+ * on another connection while the first one still has the old index
+ * open. The new index must not adopt the old summaries.
+ */
+static void test_share_recreated_table(void)
+{
+    const char *path = "regress_share_recreate.db";
+    sqlite3 *a = create_db(path);
+    sqlite3 *b = NULL;
+    sqlite3_int64 n = -1;
+    int ok, same = 0, fresh = 0;
+
+    ok = a != NULL && exec_sql(a,
+        "CREATE VIRTUAL TABLE bi USING brin(logs, v, 128);"
+        "SELECT count(*) FROM bi;") == SQLITE_OK;
+
+    if (ok) {
+        b = open_db(path);
+        ok = b != NULL && exec_sql(b,
+            "DROP TABLE bi;"
+            "DROP TABLE logs;"
+            "CREATE TABLE logs (id INTEGER PRIMARY KEY, v INTEGER);"
+            "WITH RECURSIVE c(x) AS "
+            "(SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 20000) "
+            "INSERT INTO logs SELECT x, x FROM c;"
+            "CREATE VIRTUAL TABLE b2 USING brin(logs, v, 128);") == SQLITE_OK;
+    }
+
+    same = ok &&
+           query_int64(b, "SELECT brin_count('b2', 5001, 5100);",
+                       &n) == SQLITE_OK &&
+           n == 100 &&
+           join_mismatch(b, "b2", 0, 20000) == 0;
+
+    sqlite3_close(b);
+    b = NULL;
+
+    if (same) {
+        b = open_db(path);
+        fresh = b != NULL &&
+                query_int64(b, "SELECT brin_count('b2', 5001, 5100);",
+                            &n) == SQLITE_OK &&
+                n == 100;
+    }
+
+    check("share: index of a recreated table is built, not adopted", same);
+    check("share: its stored summaries reload on a new connection", fresh);
+
+    sqlite3_close(b);
+    sqlite3_close(a);
+    remove_db(path);
+}
+
+/* ===== catch-up on connect ===== */
+
+/*
+ * The first query of a connection inside BEGIN, with rows appended
+ * since the index was saved. Catching up must not turn its read
+ * transaction into a write transaction and lock out other writers.
+ */
+static void test_connect_catchup_in_read_txn(void)
+{
+    const char *path = "regress_connect_read_txn.db";
+    sqlite3 *a = create_db(path);
+    sqlite3 *r = NULL;
+    sqlite3_int64 n = -1;
+    int ok, reader = 0, writer = 0;
+
+    ok = a != NULL && exec_sql(a,
+        "CREATE VIRTUAL TABLE bi USING brin(logs, v, 128);") == SQLITE_OK;
+
+    sqlite3_close(a);
+    a = NULL;
+
+    if (ok) {
+        a = open_db(path);
+        r = open_db(path);
+        ok = a != NULL && r != NULL && exec_sql(a,
+            "INSERT INTO logs SELECT id + 100000, v + 1000000 "
+            "FROM logs WHERE id <= 1000;") == SQLITE_OK;
+    }
+
+    if (ok) {
+        reader = exec_sql(r, "BEGIN;") == SQLITE_OK &&
+                 query_int64(r, "SELECT brin_count('bi', 1000010, 1010000);",
+                             &n) == SQLITE_OK &&
+                 n == 1000 &&
+                 sqlite3_txn_state(r, "main") != SQLITE_TXN_WRITE;
+
+        writer = exec_sql(a, "INSERT INTO logs VALUES (200000, 1);")
+                 == SQLITE_OK;
+
+        exec_sql(r, "COMMIT;");
+    }
+
+    check("connect: catch-up inside BEGIN stays a read transaction",
+          reader);
+    check("connect: other writers are not blocked by it", writer);
+
+    sqlite3_close(r);
+    sqlite3_close(a);
+    remove_db(path);
+}
+
+/* ===== track=on ===== */
+
+/*
+ * An update, then a delete of the head that drops the blocks the
+ * update touched. Later connections read a log entry that points
+ * only at dropped blocks.
+ */
+static void test_track_dropped_blocks(void)
+{
+    const char *path = "regress_track_drop.db";
+    sqlite3 *db = create_db(path);
+    int ok = db != NULL;
+    int i;
+
+    ok = ok && exec_sql(db,
+        "CREATE VIRTUAL TABLE b USING brin(logs, v, 128, track=on);"
+        "UPDATE logs SET v = v + 1 WHERE rowid = 20;"
+        "SELECT count(*) FROM b;"
+        "DELETE FROM logs WHERE rowid < 5000;"
+        "SELECT count(*) FROM b;") == SQLITE_OK;
+
+    sqlite3_close(db);
+
+    for (i = 0; ok && i < 2; i++) {
+        db = open_db(path);
+        ok = db != NULL && join_mismatch(db, "b", 0, 10 * TEST_ROWS) == 0;
+        sqlite3_close(db);
+    }
+
+    check("track: log entry on dropped blocks, reconnect twice", ok);
+    remove_db(path);
+}
+
+/*
+ * A resummarize entry read by a connection inside a write
+ * transaction.
+ */
+static void test_track_resummarize_in_write_txn(void)
+{
+    const char *path = "regress_track_txn.db";
+    sqlite3 *db = create_db(path);
+    sqlite3 *db2 = NULL;
+    sqlite3_int64 n = 0;
+    int ok = db != NULL;
+
+    ok = ok && exec_sql(db,
+        "CREATE VIRTUAL TABLE b USING brin(logs, v, 128, track=on);"
+        "DELETE FROM logs WHERE rowid BETWEEN 500 AND 600;"
+        "SELECT brin_resummarize('b');") == SQLITE_OK;
+
+    if (ok) {
+        db2 = open_db(path);
+        ok = db2 != NULL &&
+             exec_sql(db2,
+                "BEGIN;"
+                "INSERT INTO logs (v) VALUES (99999999);") == SQLITE_OK &&
+             query_int64(db2, "SELECT count(*) FROM b;", &n) == SQLITE_OK &&
+             exec_sql(db2, "COMMIT;") == SQLITE_OK &&
+             join_mismatch(db2, "b", 0, 100000000) == 0;
+    }
+
+    sqlite3_close(db2);
+    sqlite3_close(db);
+
+    check("track: resummarize entry read inside a write transaction", ok);
+    remove_db(path);
+}
+
+/*
+ * A DELETE of the newest rows lets SQLite hand their rowids out
+ * again. The rows inserted under them must be found, whether or not
+ * the index was queried between the DELETE and the INSERT.
+ */
+static void test_track_reused_tail_rowids(void)
+{
+    const char *path = "regress_track_reuse.db";
+    const char *between[2] = { "", "SELECT count(*) FROM bi;" };
+
+    for (int k = 0; k < 2; k++) {
+        sqlite3 *db;
+        sqlite3_int64 n = -1, scan = -1;
+        char sql[1024];
+        int ok;
+
+        remove_db(path);
+        db = open_db(path);
+
+        snprintf(sql, sizeof(sql),
+            "PRAGMA journal_mode = WAL;"
+            "CREATE TABLE t (ts INTEGER);"
+            "WITH RECURSIVE c(x) AS "
+            "(SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 1500) "
+            "INSERT INTO t SELECT x FROM c;"
+            "CREATE VIRTUAL TABLE bi USING brin(t, ts, 64, track=on);"
+            "SELECT count(*) FROM bi;"
+            "DELETE FROM t WHERE rowid > 1400;"
+            "%s"
+            "WITH RECURSIVE c(x) AS "
+            "(SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 50) "
+            "INSERT INTO t SELECT 11400 + x FROM c;",
+            between[k]);
+
+        ok = db != NULL && exec_sql(db, sql) == SQLITE_OK &&
+             query_int64(db, "SELECT brin_count('bi', 11000, 12000);",
+                         &n) == SQLITE_OK &&
+             query_int64(db, "SELECT count(*) FROM "
+                         "brin_scan('bi', 11000, 12000);",
+                         &scan) == SQLITE_OK;
+
+        check(k == 0
+                ? "track: rows under reused rowids are found"
+                : "track: reused rowids after a query between",
+              ok && n == 50 && scan == 50);
+
+        sqlite3_close(db);
+    }
+
+    remove_db(path);
+}
+
+/*
+ * brin_truncate_before after a DELETE of a prefix: with
+ * track=on its own catch-up drops the blocks, which must
+ * still be counted, on the same connection and on a new one.
+ */
+static void test_truncate_before_count(void)
+{
+    const char *path = "regress_truncate.db";
+    sqlite3 *db = create_db(path);
+    sqlite3_int64 dropped = -1;
+    int same = 0, fresh = 0, again = 0;
+
+    if (db &&
+        exec_sql(db,
+            "CREATE VIRTUAL TABLE b USING brin(logs, v, 128, track=on);"
+            "DELETE FROM logs WHERE rowid <= 128 * 10;") == SQLITE_OK &&
+        query_int64(db, "SELECT brin_truncate_before('b');",
+                    &dropped) == SQLITE_OK)
+    {
+        same = dropped == 10;
+    }
+
+    sqlite3_close(db);
+    db = NULL;
+
+    /*
+     * The DELETE runs without the extension's table open, so the
+     * next connection catches up inside brin_truncate_before.
+     */
+    if (same && sqlite3_open(path, &db) == SQLITE_OK &&
+        exec_sql(db, "DELETE FROM logs WHERE rowid <= 128 * 25;") == SQLITE_OK)
+    {
+        sqlite3_close(db);
+        db = open_db(path);
+
+        fresh = db != NULL &&
+                query_int64(db, "SELECT brin_truncate_before('b');",
+                            &dropped) == SQLITE_OK &&
+                dropped == 15;
+
+        again = fresh &&
+                query_int64(db, "SELECT brin_truncate_before('b');",
+                            &dropped) == SQLITE_OK &&
+                dropped == 0 &&
+                join_mismatch(db, "b", 0, 10 * TEST_ROWS) == 0;
+    }
+
+    sqlite3_close(db);
+
+    check("truncate: count after a prefix DELETE, same connection", same);
+    check("truncate: count after a prefix DELETE, new connection", fresh);
+    check("truncate: nothing left to drop", again);
+    remove_db(path);
+}
+
+/* ===== shm= and file= files ===== */
+
+/*
+ * DROP TABLE removes the shm=on segment and the file= summary file,
+ * and ALTER TABLE ... RENAME TO moves the segment to the new name.
+ */
+static void test_files_follow_table(void)
+{
+    const char *path = "regress_files.db";
+    sqlite3 *db = create_db(path);
+    sqlite3_int64 n = -1;
+    int ok, created, renamed, dropped;
+
+    remove("regress_files.db-brin-bi");
+    remove("regress_files.db-brin-bj");
+    remove("regress_files.db-brin-bf");
+    remove("regress_files.brin");
+
+    ok = db != NULL && exec_sql(db,
+        "CREATE VIRTUAL TABLE bi USING brin(logs, v, 128, shm=on);"
+        "CREATE VIRTUAL TABLE bf USING brin(logs, v, 128, "
+        "file=regress_files.brin);"
+        "SELECT count(*) FROM bi;"
+        "SELECT count(*) FROM bf;") == SQLITE_OK;
+
+    created = ok &&
+              file_exists("regress_files.db-brin-bi") &&
+              file_exists("regress_files.brin");
+
+    renamed = ok &&
+              exec_sql(db, "ALTER TABLE bi RENAME TO bj;") == SQLITE_OK &&
+              !file_exists("regress_files.db-brin-bi") &&
+              file_exists("regress_files.db-brin-bj") &&
+              query_int64(db, "SELECT brin_count('bj', 10, 1000);",
+                          &n) == SQLITE_OK &&
+              n == 100;
+
+    dropped = ok &&
+              exec_sql(db, "DROP TABLE bj; DROP TABLE bf;") == SQLITE_OK &&
+              !file_exists("regress_files.db-brin-bj") &&
+              !file_exists("regress_files.brin");
+
+    check("files: shm= segment and file= summary file are created",
+          created);
+    check("files: RENAME TO moves the shm= segment", renamed);
+    check("files: DROP TABLE removes the segment and the summary file",
+          dropped);
+
+    sqlite3_close(db);
+    remove("regress_files.db-brin-bi");
+    remove("regress_files.db-brin-bj");
+    remove("regress_files.brin");
+    remove_db(path);
+}
+
+/* ===== TEXT datetimes ===== */
+
+/*
+ * A bound that is not a full datetime used to be parsed past
+ * its terminator, and brin_scan returned rows the base table
+ * does not match. It must be an error now.
+ */
+static void test_text_partial_datetime_bound(void)
+{
+    const char *path = "regress_text_bound.db";
+    sqlite3 *db;
+    sqlite3_int64 found = -1, truth = -2;
+    int ok;
+
+    remove_db(path);
+
+    db = open_db(path);
+    ok = db != NULL && exec_sql(db,
+        "CREATE TABLE t (ts TEXT);"
+        "WITH RECURSIVE c(x) AS "
+        "(SELECT 0 UNION ALL SELECT x + 1 FROM c WHERE x < 1999) "
+        "INSERT INTO t SELECT datetime(1690000000 + x * 3600, 'unixepoch') "
+        "FROM c;"
+        "CREATE VIRTUAL TABLE b USING brin(t, ts, 64);") == SQLITE_OK;
+
+    check("text: partial datetime bound in brin_scan is an error",
+          ok && sqlite3_exec(db,
+              "SELECT count(*) FROM brin_scan('b', '2023-11-15', NULL);",
+              NULL, NULL, NULL) != SQLITE_OK);
+
+    check("text: partial datetime bound on the table is an error",
+          ok && sqlite3_exec(db,
+              "SELECT count(*) FROM b WHERE value >= '2023-11-15';",
+              NULL, NULL, NULL) != SQLITE_OK);
+
+    ok = ok &&
+         query_int64(db,
+            "SELECT count(*) FROM brin_scan('b', '2023-09-01 00:00:00', NULL);",
+            &found) == SQLITE_OK &&
+         query_int64(db,
+            "SELECT count(*) FROM t WHERE ts >= '2023-09-01 00:00:00';",
+            &truth) == SQLITE_OK;
+
+    check("text: full datetime bound in brin_scan", ok && found == truth);
+
+    sqlite3_close(db);
+    remove_db(path);
+}
+
+/* ===== brin_histogram ===== */
+
+/*
+ * 1 when the histogram query returns the same (bucket, rows)
+ * list as the reference query.
+ */
+static int same_histogram(sqlite3 *db, const char *hist, const char *truth)
+{
+    sqlite3_int64 same = 0;
+    char sql[1024];
+
+    snprintf(sql, sizeof(sql),
+        "SELECT (SELECT group_concat(bucket || ':' || rows, ' ') FROM (%s)) "
+        "IS (SELECT group_concat(bucket || ':' || rows, ' ') FROM (%s));",
+        hist, truth);
+
+    return query_int64(db, sql, &same) == SQLITE_OK && same == 1;
+}
+
+static void test_histogram_bounds(void)
+{
+    const char *path = "regress_histogram.db";
+    sqlite3 *db;
+    int ok;
+
+    remove_db(path);
+
+    db = open_db(path);
+    ok = db != NULL && exec_sql(db,
+        "CREATE TABLE r (x REAL);"
+        "INSERT INTO r VALUES (-0.5), (-0.25), (0.5), (1.5);"
+        "CREATE VIRTUAL TABLE rb USING brin(r, x, 2, order=none);"
+        "CREATE TABLE i (x INTEGER);"
+        "WITH RECURSIVE c(n) AS "
+        "(SELECT -500 UNION ALL SELECT n + 1 FROM c WHERE n < 500) "
+        "INSERT INTO i SELECT n * 7 FROM c;"
+        "INSERT INTO i VALUES (9223372036854775800), (9223372036854775806);"
+        "CREATE VIRTUAL TABLE ib USING brin(i, x, 16);") == SQLITE_OK;
+
+    check("histogram: integer bounds on a REAL column keep negatives",
+          ok && same_histogram(db,
+              "SELECT bucket, rows FROM brin_histogram('rb', -5, 5, 1)",
+              "SELECT CAST(floor(x) AS INTEGER) * 1.0 AS bucket, "
+              "count(*) AS rows FROM r GROUP BY 1 ORDER BY 1"));
+
+    check("histogram: negative keys use floor buckets",
+          ok && same_histogram(db,
+              "SELECT bucket, rows FROM brin_histogram('ib', -3000, 3000, 60)",
+              "SELECT CAST(floor(x * 1.0 / 60) AS INTEGER) * 60 AS bucket, "
+              "count(*) AS rows FROM i WHERE x BETWEEN -3000 AND 3000 "
+              "GROUP BY 1 ORDER BY 1"));
+
+    check("histogram: NULL bounds are open",
+          ok && same_histogram(db,
+              "SELECT bucket, rows FROM brin_histogram('rb', NULL, NULL, 1)",
+              "SELECT CAST(floor(x) AS INTEGER) * 1.0 AS bucket, "
+              "count(*) AS rows FROM r GROUP BY 1 ORDER BY 1"));
+
+    check("histogram: high near INT64_MAX ends at the last bucket",
+          ok && same_histogram(db,
+              "SELECT bucket, rows FROM brin_histogram('ib', "
+              "9223372036854775000, 9223372036854775807, 7)",
+              "SELECT 9223372036854775800 AS bucket, 2 AS rows"));
+
+    check("histogram: too many buckets is an error",
+          ok && sqlite3_exec(db,
+              "SELECT * FROM brin_histogram('ib', -9223372036854775808, "
+              "9223372036854775807, 1);",
+              NULL, NULL, NULL) != SQLITE_OK);
+
+    sqlite3_close(db);
+    remove_db(path);
+}
+
+int main(void)
+{
+    test_commit_keeps_app_hooks();
+    test_commit_attached_schema();
+    test_parallel_attached_schema();
+    test_share_recreated_table();
+    test_connect_catchup_in_read_txn();
+    test_track_dropped_blocks();
+    test_track_resummarize_in_write_txn();
+    test_track_reused_tail_rowids();
+    test_truncate_before_count();
+    test_files_follow_table();
+    test_text_partial_datetime_bound();
+    test_histogram_bounds();
+
+    printf("%d failure(s)\n", failures);
+
+    return failures;
+}